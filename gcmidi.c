@@ -11,10 +11,20 @@
 #include <alsa/asoundlib.h>
 #include <dirent.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
 
 #define MIDI_PORT_NAME "DS4 Controller"
+#define MIDI_CLOCK_PORT_NAME "DS4 Clock In"
 #define MIDI_CHANNEL 0
 
+#define CLOCK_PPQN 24
+#define DEFAULT_BPM 120
+#define WHEEL_SLOTS 64
+#define WHEEL_POOL 32
+#define MAX_HELD 4
+
 #define CC_L2 20
 #define CC_R2 21
 #define CC_LEFT_X_NEG 22
@@ -55,8 +65,51 @@ typedef struct {
     int dpad_x, dpad_y;
 } controller_state_t;
 
+typedef enum { REPEAT_OFF, REPEAT_NOTE, REPEAT_ARP } repeat_mode_t;
+typedef enum { ARP_UP, ARP_DOWN, ARP_UPDOWN } arp_pattern_t;
+typedef enum { CLOCK_MIDI, CLOCK_INTERNAL } clock_source_t;
+typedef enum { TIMER_STEP, TIMER_NOTE_OFF } timer_kind_t;
+
+/* Timer wheel entry; due is an absolute clock tick. */
+typedef struct {
+    unsigned int due;
+    timer_kind_t kind;
+    int note;
+    int next;
+} timer_entry_t;
+
+/* Fixed-size wheel of WHEEL_SLOTS ticks backed by a static entry pool,
+ * so scheduling never allocates. now is the next tick to be processed. */
+typedef struct {
+    int slots[WHEEL_SLOTS];
+    timer_entry_t pool[WHEEL_POOL];
+    int free_list;
+    unsigned int now;
+} timer_wheel_t;
+
+typedef struct {
+    repeat_mode_t mode;
+    arp_pattern_t pattern;
+    clock_source_t clock;
+    int bpm;
+    int step_ticks;
+    int gate_ticks;
+    int running;
+    int catching_up;
+    int step_missed;
+    unsigned int song_pos;
+    int held[MAX_HELD];
+    int held_count;
+    int arp_pos;
+    int sounding[128];
+    int off_entry[128];
+    timer_wheel_t wheel;
+} repeat_engine_t;
+
 snd_seq_t *seq;
 int port;
+int clock_port = -1;
+repeat_engine_t engine = { .mode = REPEAT_OFF, .clock = CLOCK_MIDI, .bpm = DEFAULT_BPM, .step_ticks = 6 };
 volatile sig_atomic_t running = 1;
 
 typedef struct {
@@ -72,8 +125,9 @@ void handle_signal(int sig) {
     printf("\nShutting down...\n");
 }
 
-void init_midi() {
-    if (snd_seq_open(&seq, "default", SND_SEQ_OPEN_OUTPUT, 0) < 0) {
+void init_midi(int with_clock_input) {
+    int mode = with_clock_input ? SND_SEQ_OPEN_DUPLEX : SND_SEQ_OPEN_OUTPUT;
+    if (snd_seq_open(&seq, "default", mode, 0) < 0) {
         fprintf(stderr, "Error opening ALSA sequencer\n");
         exit(1);
     }
@@ -87,6 +141,18 @@ void init_midi() {
     }
     printf("MIDI port '%s' created (client %d, port %d)\n", 
            MIDI_PORT_NAME, snd_seq_client_id(seq), port);
+    
+    if (with_clock_input) {
+        clock_port = snd_seq_create_simple_port(seq, MIDI_CLOCK_PORT_NAME,
+            SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE,
+            SND_SEQ_PORT_TYPE_MIDI_GENERIC | SND_SEQ_PORT_TYPE_APPLICATION);
+        if (clock_port < 0) {
+            fprintf(stderr, "Error creating clock input port\n");
+            exit(1);
+        }
+        printf("MIDI clock input '%s' created (client %d, port %d)\n",
+               MIDI_CLOCK_PORT_NAME, snd_seq_client_id(seq), clock_port);
+    }
 }
 
 void send_cc(int cc, int value) {
@@ -119,6 +185,311 @@ void send_note_off(int note, int velocity) {
     snd_seq_event_output_direct(seq, &ev);
 }
 
+void wheel_reset(timer_wheel_t *w) {
+    for (int i = 0; i < WHEEL_SLOTS; i++) {
+        w->slots[i] = -1;
+    }
+    for (int i = 0; i < WHEEL_POOL; i++) {
+        w->pool[i].next = (i + 1 < WHEEL_POOL) ? i + 1 : -1;
+    }
+    w->free_list = 0;
+}
+
+/* Returns the pool index of the new entry, or -1 if the pool is full. */
+int wheel_schedule(timer_wheel_t *w, unsigned int delay, timer_kind_t kind, int note) {
+    int idx = w->free_list;
+    if (idx < 0) {
+        return -1;
+    }
+    timer_entry_t *e = &w->pool[idx];
+    w->free_list = e->next;
+    e->due = w->now + delay;
+    e->kind = kind;
+    e->note = note;
+    e->next = w->slots[e->due % WHEEL_SLOTS];
+    w->slots[e->due % WHEEL_SLOTS] = idx;
+    return idx;
+}
+
+void wheel_cancel(timer_wheel_t *w, int idx) {
+    int *link = &w->slots[w->pool[idx].due % WHEEL_SLOTS];
+    while (*link >= 0 && *link != idx) {
+        link = &w->pool[*link].next;
+    }
+    if (*link == idx) {
+        *link = w->pool[idx].next;
+        w->pool[idx].next = w->free_list;
+        w->free_list = idx;
+    }
+}
+
+void engine_fire(const timer_entry_t *e, int idx);
+
+/* Fires every entry due on the current tick, then moves to the next one.
+ * Entries more than WHEEL_SLOTS ticks out stay linked until their lap. */
+void wheel_advance(timer_wheel_t *w) {
+    int slot = w->now % WHEEL_SLOTS;
+    int idx = w->slots[slot];
+    w->slots[slot] = -1;
+    while (idx >= 0) {
+        timer_entry_t *e = &w->pool[idx];
+        int next = e->next;
+        if (e->due == w->now) {
+            timer_entry_t fired = *e;
+            e->next = w->free_list;
+            w->free_list = idx;
+            engine_fire(&fired, idx);
+        } else {
+            e->next = w->slots[slot];
+            w->slots[slot] = idx;
+        }
+        idx = next;
+    }
+    w->now++;
+}
+
+int parse_rate(const char *rate) {
+    if (strcmp(rate, "4") == 0) return CLOCK_PPQN;
+    if (strcmp(rate, "8") == 0) return CLOCK_PPQN / 2;
+    if (strcmp(rate, "8t") == 0) return CLOCK_PPQN / 3;
+    if (strcmp(rate, "16") == 0) return CLOCK_PPQN / 4;
+    if (strcmp(rate, "16t") == 0) return CLOCK_PPQN / 6;
+    if (strcmp(rate, "32") == 0) return CLOCK_PPQN / 8;
+    return -1;
+}
+
+/* Drops the pending gate note-off for a note, so each note holds at most
+ * one wheel entry no matter how often it is retriggered. */
+void engine_cancel_gate(int note) {
+    if (engine.off_entry[note] >= 0) {
+        wheel_cancel(&engine.wheel, engine.off_entry[note]);
+        engine.off_entry[note] = -1;
+    }
+}
+
+void engine_reset_timers() {
+    wheel_reset(&engine.wheel);
+    for (int note = 0; note < 128; note++) {
+        engine.off_entry[note] = -1;
+    }
+}
+
+void engine_note_on(int note) {
+    engine_cancel_gate(note);
+    if (engine.sounding[note]) {
+        send_note_off(note, 0);
+    }
+    send_note_on(note, 127);
+    engine.sounding[note] = 1;
+    if (engine.running) {
+        engine.off_entry[note] = wheel_schedule(&engine.wheel, engine.gate_ticks, TIMER_NOTE_OFF, note);
+    }
+}
+
+void engine_note_off(int note) {
+    engine_cancel_gate(note);
+    if (engine.sounding[note]) {
+        send_note_off(note, 0);
+        engine.sounding[note] = 0;
+    }
+}
+
+void engine_all_notes_off() {
+    for (int note = 0; note < 128; note++) {
+        engine_note_off(note);
+    }
+}
+
+int arp_next_note() {
+    int sorted[MAX_HELD];
+    int n = engine.held_count;
+    
+    for (int i = 0; i < n; i++) {
+        int j = i;
+        while (j > 0 && sorted[j - 1] > engine.held[i]) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = engine.held[i];
+    }
+    
+    int pos = engine.arp_pos++;
+    switch (engine.pattern) {
+        case ARP_DOWN:
+            return sorted[n - 1 - pos % n];
+        case ARP_UPDOWN:
+            if (n > 1) {
+                pos %= 2 * n - 2;
+                return (pos < n) ? sorted[pos] : sorted[2 * n - 2 - pos];
+            }
+            return sorted[0];
+        case ARP_UP:
+        default:
+            return sorted[pos % n];
+    }
+}
+
+void engine_play_step() {
+    if (engine.mode == REPEAT_NOTE) {
+        for (int i = 0; i < engine.held_count; i++) {
+            engine_note_on(engine.held[i]);
+        }
+    } else if (engine.mode == REPEAT_ARP && engine.held_count > 0) {
+        engine_note_on(arp_next_note());
+    }
+}
+
+void engine_fire(const timer_entry_t *e, int idx) {
+    switch (e->kind) {
+        case TIMER_NOTE_OFF:
+            /* A retrigger on this same tick may have replaced the gate. */
+            if (engine.off_entry[e->note] != idx) {
+                break;
+            }
+            engine.off_entry[e->note] = -1;
+            engine_note_off(e->note);
+            break;
+        case TIMER_STEP:
+            engine.step_missed = engine.catching_up;
+            if (!engine.catching_up) {
+                engine_play_step();
+            }
+            if (wheel_schedule(&engine.wheel, engine.step_ticks, TIMER_STEP, 0) < 0) {
+                fprintf(stderr, "Timer pool exhausted, stopping note repeat\n");
+                engine.running = 0;
+            }
+            break;
+    }
+}
+
+/* Starts stepping from the current song position, aligned to the step grid. */
+void engine_start() {
+    engine_all_notes_off();
+    engine_reset_timers();
+    engine.running = 1;
+    unsigned int delay = (engine.step_ticks - engine.song_pos % engine.step_ticks) % engine.step_ticks;
+    wheel_schedule(&engine.wheel, delay, TIMER_STEP, 0);
+}
+
+/* Buttons still held when the transport stops go back to playing directly. */
+void engine_stop() {
+    engine.running = 0;
+    engine_all_notes_off();
+    engine_reset_timers();
+    for (int i = 0; i < engine.held_count; i++) {
+        engine_note_on(engine.held[i]);
+    }
+}
+
+void engine_tick() {
+    if (!engine.running) {
+        return;
+    }
+    wheel_advance(&engine.wheel);
+    engine.song_pos++;
+}
+
+/* Face button press. With the clock stopped the note plays directly until
+ * release; while running, note-repeat sounds it at once and then on every
+ * step, and the arpeggiator only picks it up on the next step. */
+void face_note_on(int note) {
+    if (engine.mode == REPEAT_OFF) {
+        send_note_on(note, 127);
+        return;
+    }
+    if (engine.held_count < MAX_HELD) {
+        engine.held[engine.held_count++] = note;
+    }
+    if (!engine.running || engine.mode == REPEAT_NOTE) {
+        engine_note_on(note);
+    }
+}
+
+void face_note_off(int note) {
+    if (engine.mode == REPEAT_OFF) {
+        send_note_off(note, 0);
+        return;
+    }
+    for (int i = 0; i < engine.held_count; i++) {
+        if (engine.held[i] == note) {
+            memmove(&engine.held[i], &engine.held[i + 1],
+                    (engine.held_count - i - 1) * sizeof(engine.held[0]));
+            engine.held_count--;
+            break;
+        }
+    }
+    if (engine.held_count == 0) {
+        engine.arp_pos = 0;
+    }
+    engine_note_off(note);
+}
+
+int open_clock_timer(int bpm) {
+    int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+        return -1;
+    }
+    /* Periodic expirations are counted by the kernel, so a late wakeup
+     * never shifts the grid: missed ticks are returned on the next read. */
+    long long period_ns = 60000000000LL / ((long long)bpm * CLOCK_PPQN);
+    struct itimerspec its;
+    its.it_interval.tv_sec = period_ns / 1000000000LL;
+    its.it_interval.tv_nsec = period_ns % 1000000000LL;
+    its.it_value = its.it_interval;
+    if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+        close(tfd);
+        return -1;
+    }
+    return tfd;
+}
+
+void process_timer_clock(int tfd) {
+    uint64_t expirations;
+    if (read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+        return;
+    }
+    /* After a late wakeup, step over the missed ticks to stay on the grid
+     * but only play the most recent step instead of a burst of them. */
+    engine.catching_up = 1;
+    while (expirations-- > 1) {
+        engine_tick();
+    }
+    engine.catching_up = 0;
+    engine_tick();
+    if (engine.step_missed) {
+        engine_play_step();
+        engine.step_missed = 0;
+    }
+}
+
+void process_midi_clock() {
+    snd_seq_event_t *sev;
+    do {
+        if (snd_seq_event_input(seq, &sev) < 0) {
+            break;
+        }
+        switch (sev->type) {
+            case SND_SEQ_EVENT_CLOCK:
+                engine_tick();
+                break;
+            case SND_SEQ_EVENT_START:
+                engine.song_pos = 0;
+                engine_start();
+                break;
+            case SND_SEQ_EVENT_CONTINUE:
+                engine_start();
+                break;
+            case SND_SEQ_EVENT_STOP:
+                engine_stop();
+                break;
+            case SND_SEQ_EVENT_SONGPOS:
+                /* Song position pointer counts sixteenth notes. */
+                engine.song_pos = sev->data.control.value * (CLOCK_PPQN / 4);
+                break;
+        }
+    } while (snd_seq_event_input_pending(seq, 0) > 0);
+}
+
 int scale_trigger(int value, int max) {
     return value * 127 / max;
 }
@@ -149,11 +520,20 @@ void print_usage() {
     printf("  -c, --controller     Use controller inputs (buttons, sticks, triggers) [DEFAULT]\n");
     printf("  -m, --motion         Use motion sensors (accelerometer, gyroscope)\n");
     printf("  -t, --touchpad       Use touchpad input\n");
+    printf("  -r, --repeat         Retrigger held face buttons in time with the clock\n");
+    printf("  -a, --arp MODE       Arpeggiate held face buttons (up, down, updown)\n");
+    printf("      --rate DIV       Step length: 4, 8, 8t, 16, 16t, 32 [DEFAULT: 16]\n");
+    printf("      --clock SOURCE   Clock source: midi, internal [DEFAULT: midi]\n");
+    printf("      --bpm N          Tempo of the internal clock [DEFAULT: %d]\n", DEFAULT_BPM);
     printf("  -h, --help           Show this help\n");
     printf("\n");
     printf("Device Selection:\n");
     printf("  The DS4 creates 3 separate HID devices. Choose ONE type to avoid conflicts.\n");
     printf("  Default: controller inputs (recommended for MIDI control)\n");
+    printf("\n");
+    printf("Clock Sync:\n");
+    printf("  With --clock midi, connect the DAW's clock output to the '%s' port.\n", MIDI_CLOCK_PORT_NAME);
+    printf("  While the transport is stopped, face buttons play directly.\n");
 }
 
 void list_available_devices() {
@@ -304,6 +684,8 @@ int main(int argc, char *argv[]) {
     
     char *controller_path = NULL;
     const char *device_type = "controller";
+    const char *clock_option = NULL;
+    int bpm_given = 0;
     
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
@@ -326,6 +708,51 @@ int main(int argc, char *argv[]) {
             device_type = "touchpad";
         } else if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--controller") == 0) {
             device_type = "controller";
+        } else if (strcmp(argv[i], "-r") == 0 || strcmp(argv[i], "--repeat") == 0) {
+            engine.mode = REPEAT_NOTE;
+        } else if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--arp") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: --arp requires a mode argument\n");
+                return 1;
+            }
+            i++;
+            if (strcmp(argv[i], "up") == 0) {
+                engine.pattern = ARP_UP;
+            } else if (strcmp(argv[i], "down") == 0) {
+                engine.pattern = ARP_DOWN;
+            } else if (strcmp(argv[i], "updown") == 0) {
+                engine.pattern = ARP_UPDOWN;
+            } else {
+                fprintf(stderr, "Error: unknown arpeggiator mode: %s\n", argv[i]);
+                return 1;
+            }
+            engine.mode = REPEAT_ARP;
+        } else if (strcmp(argv[i], "--rate") == 0) {
+            if (i + 1 >= argc || (engine.step_ticks = parse_rate(argv[i + 1])) < 0) {
+                fprintf(stderr, "Error: --rate requires one of 4, 8, 8t, 16, 16t, 32\n");
+                return 1;
+            }
+            clock_option = argv[i];
+            i++;
+        } else if (strcmp(argv[i], "--clock") == 0) {
+            if (i + 1 < argc && strcmp(argv[i + 1], "midi") == 0) {
+                engine.clock = CLOCK_MIDI;
+            } else if (i + 1 < argc && strcmp(argv[i + 1], "internal") == 0) {
+                engine.clock = CLOCK_INTERNAL;
+            } else {
+                fprintf(stderr, "Error: --clock requires 'midi' or 'internal'\n");
+                return 1;
+            }
+            clock_option = argv[i];
+            i++;
+        } else if (strcmp(argv[i], "--bpm") == 0) {
+            if (i + 1 >= argc || (engine.bpm = atoi(argv[i + 1])) < 20 || engine.bpm > 300) {
+                fprintf(stderr, "Error: --bpm requires a tempo between 20 and 300\n");
+                return 1;
+            }
+            clock_option = argv[i];
+            bpm_given = 1;
+            i++;
         } else if (argv[i][0] == '-') {
             fprintf(stderr, "Unknown option: %s\n", argv[i]);
             print_usage();
@@ -335,6 +762,14 @@ int main(int argc, char *argv[]) {
         }
     }
     
+    if (clock_option && engine.mode == REPEAT_OFF) {
+        fprintf(stderr, "Error: %s requires --repeat or --arp\n", clock_option);
+        return 1;
+    }
+    if (bpm_given && engine.clock == CLOCK_MIDI) {
+        printf("Warning: --bpm only applies to --clock internal; tempo follows MIDI clock\n");
+    }
+    
     if (!controller_path) {
         printf("Auto-detecting DS4 %s device...\n", device_type);
         controller_path = find_ds4_device_by_type(device_type);
@@ -365,7 +800,42 @@ int main(int argc, char *argv[]) {
     
     printf("Controller: %s\n", libevdev_get_name(dev));
     
-    init_midi();
+    int use_midi_clock = engine.mode != REPEAT_OFF && engine.clock == CLOCK_MIDI;
+    init_midi(use_midi_clock);
+    
+    struct pollfd pfds[8];
+    int nfds = 0;
+    int timer_fd = -1;
+    
+    pfds[nfds].fd = fd;
+    pfds[nfds].events = POLLIN;
+    nfds++;
+    
+    if (engine.mode != REPEAT_OFF) {
+        engine.gate_ticks = (engine.step_ticks > 1) ? engine.step_ticks / 2 : 1;
+        engine_reset_timers();
+        
+        if (engine.clock == CLOCK_INTERNAL) {
+            timer_fd = open_clock_timer(engine.bpm);
+            if (timer_fd < 0) {
+                fprintf(stderr, "Cannot create clock timer: %s\n", strerror(errno));
+                libevdev_free(dev);
+                close(fd);
+                snd_seq_close(seq);
+                return 1;
+            }
+            pfds[nfds].fd = timer_fd;
+            pfds[nfds].events = POLLIN;
+            nfds++;
+            engine_start();
+            printf("Clock: internal, %d BPM\n", engine.bpm);
+        } else {
+            nfds += snd_seq_poll_descriptors(seq, &pfds[nfds], 8 - nfds, POLLIN);
+            printf("Clock: MIDI, waiting for transport start on '%s'\n", MIDI_CLOCK_PORT_NAME);
+        }
+        printf("%s: step every %d clock ticks\n",
+               engine.mode == REPEAT_ARP ? "Arpeggiator" : "Note repeat", engine.step_ticks);
+    }
     
     controller_state_t state = {0};
     
@@ -496,33 +966,33 @@ int main(int argc, char *argv[]) {
                     switch (ev.code) {
                         case BTN_WEST:
                             if (ev.value && !state.square) {
-                                send_note_on(NOTE_SQUARE, 127);
+                                face_note_on(NOTE_SQUARE);
                             } else if (!ev.value && state.square) {
-                                send_note_off(NOTE_SQUARE, 0);
+                                face_note_off(NOTE_SQUARE);
                             }
                             state.square = ev.value;
                             break;
                         case BTN_SOUTH:
                             if (ev.value && !state.cross) {
-                                send_note_on(NOTE_CROSS, 127);
+                                face_note_on(NOTE_CROSS);
                             } else if (!ev.value && state.cross) {
-                                send_note_off(NOTE_CROSS, 0);
+                                face_note_off(NOTE_CROSS);
                             }
                             state.cross = ev.value;
                             break;
                         case BTN_EAST:
                             if (ev.value && !state.circle) {
-                                send_note_on(NOTE_CIRCLE, 127);
+                                face_note_on(NOTE_CIRCLE);
                             } else if (!ev.value && state.circle) {
-                                send_note_off(NOTE_CIRCLE, 0);
+                                face_note_off(NOTE_CIRCLE);
                             }
                             state.circle = ev.value;
                             break;
                         case BTN_NORTH:
                             if (ev.value && !state.triangle) {
-                                send_note_on(NOTE_TRIANGLE, 127);
+                                face_note_on(NOTE_TRIANGLE);
                             } else if (!ev.value && state.triangle) {
-                                send_note_off(NOTE_TRIANGLE, 0);
+                                face_note_off(NOTE_TRIANGLE);
                             }
                             state.triangle = ev.value;
                             break;
@@ -602,12 +1072,27 @@ int main(int argc, char *argv[]) {
                     break;
             }
         } else if (rc == -EAGAIN) {
-            struct timespec ts = {0, 1000000};
-            nanosleep(&ts, NULL);
+            if (poll(pfds, nfds, 100) > 0) {
+                for (int i = 1; i < nfds; i++) {
+                    if (!(pfds[i].revents & POLLIN)) {
+                        continue;
+                    }
+                    if (pfds[i].fd == timer_fd) {
+                        process_timer_clock(timer_fd);
+                    } else {
+                        process_midi_clock();
+                        break;
+                    }
+                }
+            }
         }
     }
     
     printf("Cleaning up...\n");
+    if (engine.mode != REPEAT_OFF) {
+        engine_all_notes_off();
+    }
+    if (timer_fd >= 0) close(timer_fd);
     libevdev_free(dev);
     close(fd);
     snd_seq_close(seq);